@@ -8,15 +8,26 @@ import android.view.ViewGroup;
 import android.view.WindowManager;
 import android.view.WindowManager.LayoutParams;
 
+import java.util.concurrent.atomic.AtomicInteger;
+
 import javax.microedition.khronos.egl.EGLConfig;
 import javax.microedition.khronos.opengles.GL10;
 
 // HACK: It seems like there's a buffer in MediaCodec that causes the last few frames to get stuck
-//       if nothing else happens afterwards. Superimpose a GLSurfaceView over everything else to
-//       force a frame through the codec every vsync.
+//       if nothing else happens afterwards. Superimpose a GLSurfaceView over everything else, so
+//       that we can force frames through the codec when the host asks us to flush.
 
 public class PixelPoker {
     static class PixelRenderer implements GLSurfaceView.Renderer {
+        private final AtomicInteger pendingFrames = new AtomicInteger();
+        private GLSurfaceView view;
+
+        void poke(GLSurfaceView view, int frames) {
+            this.view = view;
+            pendingFrames.set(frames);
+            view.requestRender();
+        }
+
         @Override
         public void onSurfaceCreated(GL10 gl10, EGLConfig eglConfig) {
         }
@@ -27,6 +38,10 @@ public class PixelPoker {
 
         @Override
         public void onDrawFrame(GL10 gl10) {
+            // Keep drawing until we've pushed enough frames to drain the codec.
+            if (pendingFrames.getAndDecrement() > 1) {
+                view.requestRender();
+            }
         }
     }
 
@@ -38,15 +53,24 @@ public class PixelPoker {
 
             setEGLContextClientVersion(2);
             setRenderer(mRenderer);
-            setRenderMode(RENDERMODE_CONTINUOUSLY);
+            setRenderMode(RENDERMODE_WHEN_DIRTY);
+        }
+
+        void poke(int frames) {
+            mRenderer.poke(this, frames);
         }
     }
 
     private static WindowManager windowManager;
-    private static PixelView pixelView;
+    private static volatile PixelView pixelView;
     private static final int viewWidth = 10;
     private static final int viewHeight = 10;
 
+    // Number of frames to draw to flush the codec. The host counts them to tell them apart from
+    // real changes to the screen, so keep in sync with ACCESSORY_FLUSH_FRAMES in
+    // src/accessory_protocol.h.
+    private static final int flushFrames = 4;
+
     static void start(Context ctx) {
         windowManager = (WindowManager) ctx.getSystemService(Context.WINDOW_SERVICE);
 
@@ -71,6 +95,10 @@ public class PixelPoker {
         windowManager.addView(pixelView, params);
     }
 
+    static void flush() {
+        if (pixelView != null) pixelView.poke(flushFrames);
+    }
+
     public static void stop() {
         if (pixelView != null) windowManager.removeView(pixelView);
         pixelView = null;
@@ -21,16 +21,27 @@ import android.os.ParcelFileDescriptor;
 import android.util.Log;
 import android.view.Surface;
 
+import java.io.FileInputStream;
 import java.io.FileOutputStream;
 import java.io.IOException;
 import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
 import java.nio.channels.WritableByteChannel;
 
 public class StreamService extends Service {
     private static final String TAG = "StreamService";
 
+    // Commands sent by the host, one byte each. Keep in sync with src/accessory_protocol.h.
+    private static final int COMMAND_FLUSH = 1;
+
+    // The host sends everything it has queued up in one bulk transfer, and f_accessory can fail reads
+    // that are shorter than the transfer, so read commands with a buffer at least this big.
+    private static final int COMMAND_BUFFER_SIZE = 16384;
+
+    FileChannel commandChannel;
     FileOutputStream fos;
     WritableByteChannel channel;
+    Thread commandThread;
     MediaProjectionManager projectionManager;
     MediaProjection projection;
     MediaCodec videoEncoder;
@@ -70,6 +81,9 @@ public class StreamService extends Service {
         if (pfd == null) {
             throw new RuntimeException("Failed to open USB accessory");
         }
+        // A FileInputStream made from a FileDescriptor doesn't own it, but its channel can still be
+        // closed to wake up a thread that's blocked reading from it.
+        commandChannel = new FileInputStream(pfd.getFileDescriptor()).getChannel();
         fos = new ParcelFileDescriptor.AutoCloseOutputStream(pfd);
         channel = fos.getChannel();
 
@@ -105,6 +119,8 @@ public class StreamService extends Service {
         registerReceiver(rotationReceiver, filter);
 
         PixelPoker.start(this);
+        startCommandThread();
+
         Notification notification = new Notification.Builder(this)
                 .setPriority(Notification.PRIORITY_MIN)
                 .setContentTitle("mimic")
@@ -115,6 +131,36 @@ public class StreamService extends Service {
         return START_NOT_STICKY;
     }
 
+    private void startCommandThread() {
+        commandThread = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                ByteBuffer buffer = ByteBuffer.allocate(COMMAND_BUFFER_SIZE);
+                try {
+                    while (commandChannel.read(buffer) != -1) {
+                        buffer.flip();
+                        while (buffer.hasRemaining()) {
+                            int command = buffer.get() & 0xff;
+                            switch (command) {
+                                case COMMAND_FLUSH:
+                                    PixelPoker.flush();
+                                    break;
+
+                                default:
+                                    Log.e(TAG, "Unknown command from host: " + command);
+                                    break;
+                            }
+                        }
+                        buffer.clear();
+                    }
+                } catch (IOException e) {
+                    Log.i(TAG, "Command stream closed: " + e);
+                }
+            }
+        }, "mimic-commands");
+        commandThread.start();
+    }
+
     private void constructEncoder() {
         try {
             videoEncoder = MediaCodec.createEncoderByType(MediaFormat.MIMETYPE_VIDEO_AVC);
@@ -160,6 +206,14 @@ public class StreamService extends Service {
         display.release();
         surface.release();
 
+        // Closing the channel interrupts the command thread's read, so do this before fos closes
+        // the underlying file descriptor.
+        try {
+            commandChannel.close();
+        } catch (IOException e) {
+            e.printStackTrace();
+        }
+
         try {
             fos.close();
         } catch (IOException e) {
@@ -0,0 +1,12 @@
+#pragma once
+
+// Commands sent from the host to the phone over the accessory's OUT endpoint, one byte each.
+// Keep in sync with StreamService.java.
+enum class AccessoryCommand : unsigned char {
+  // Push a few frames through the phone's encoder, to drain any that are stuck in it.
+  flush = 1,
+};
+
+// How many frames the phone draws in response to AccessoryCommand::flush, and so how many frames we
+// expect back from it. Keep in sync with PixelPoker.java.
+constexpr int ACCESSORY_FLUSH_FRAMES = 4;
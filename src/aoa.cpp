@@ -20,6 +20,8 @@
 #include "aoa.h"
 #include "auto.h"
 #include "chrono_literals.h"
+#include "cpu_time.h"
+#include "trace.h"
 
 constexpr int VID_GOOGLE = 0x18D1;
 constexpr int PID_NEXUS_MTP = 0x4EE1;
@@ -55,13 +57,91 @@ constexpr char VERSION[] = "0.0.1";
 constexpr char URI[] = "https://insolit.us/mimic";
 constexpr char SERIAL[] = "0";
 
+// libusb_dev_mem_alloc showed up in libusb 1.0.21. The M3's sysroot predates that, so it always
+// uses ordinary memory.
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
+
+// How often to report the CPU cost of reading from the accessory.
+constexpr std::chrono::seconds ACCESSORY_REPORT_INTERVAL = 10s;
+
+// A transfer buffer, mapped from usbfs when possible so that the kernel can DMA to it directly
+// instead of copying every transfer to and from user memory.
+class USBBuffer {
+ private:
+  libusb_device_handle* handle;
+  unsigned char* data = nullptr;
+  size_t length;
+  bool dev_mem = false;
+
+ public:
+  USBBuffer(libusb_device_handle* handle, size_t length, bool use_dev_mem)
+      : handle(handle), length(length) {
+#if defined(HAVE_LIBUSB_DEV_MEM)
+    if (use_dev_mem) {
+      data = libusb_dev_mem_alloc(handle, length);
+      if (data) {
+        dev_mem = true;
+        return;
+      }
+      debug("failed to allocate %zu bytes of usbfs memory, falling back to user memory", length);
+    }
+#else
+    (void)use_dev_mem;
+#endif
+    data = new unsigned char[length]();
+  }
+
+  ~USBBuffer() {
+#if defined(HAVE_LIBUSB_DEV_MEM)
+    if (dev_mem) {
+      libusb_dev_mem_free(handle, data, length);
+      return;
+    }
+#endif
+    delete[] data;
+  }
+
+  USBBuffer(const USBBuffer& copy) = delete;
+  USBBuffer& operator=(const USBBuffer& copy) = delete;
+
+  unsigned char* get() {
+    return data;
+  }
+
+  size_t size() const {
+    return length;
+  }
+
+  bool is_dev_mem() const {
+    return dev_mem;
+  }
+};
+
+static void record(int fd, const void* data, size_t length) {
+  const char* current = static_cast<const char*>(data);
+  while (length > 0) {
+    ssize_t written = write(fd, current, length);
+    if (written < 0) {
+      fatal("failed to write recording: %s", strerror(errno));
+    }
+
+    current += written;
+    length -= written;
+  }
+}
+
 static bool aoa_initialize(libusb_device_handle* handle, AOAMode mode) {
+  TRACE_SCOPE("aoa_initialize");
   unsigned char aoa_version_buf[2] = {};
   int rc;
 
   // https://source.android.com/devices/accessories/aoa.html
+  TRACE_BEGIN("aoa get protocol");
   rc = libusb_control_transfer(handle, USB_DIR_IN | USB_TYPE_VENDOR, 51, 0, 0, aoa_version_buf,
                                sizeof(aoa_version_buf), 0);
+  TRACE_END("aoa get protocol");
 
   if (rc < 0) {
     error("failed to initialize AoA: %s", libusb_error_name(rc));
@@ -76,6 +156,7 @@ static bool aoa_initialize(libusb_device_handle* handle, AOAMode mode) {
   }
 
   auto sendString = [handle](int string_id, const std::string& string) {
+    TRACE_SCOPE("aoa send string");
     int rc = libusb_control_transfer(handle, USB_DIR_OUT | USB_TYPE_VENDOR, 52, 0, string_id,
                                      (unsigned char*)(string.c_str()), string.length() + 1, 0);
     if (rc < 0) {
@@ -102,6 +183,7 @@ static bool aoa_initialize(libusb_device_handle* handle, AOAMode mode) {
 }
 
 static bool aoa_enable_audio(libusb_device_handle* handle) {
+  TRACE_SCOPE("aoa_enable_audio");
   int rc = libusb_control_transfer(handle, USB_DIR_OUT | USB_TYPE_VENDOR, 58, 1, 0, nullptr, 0, 0);
   if (rc < 0) {
     error("failed to enable audio: %s", libusb_error_name(rc));
@@ -111,6 +193,7 @@ static bool aoa_enable_audio(libusb_device_handle* handle) {
 }
 
 static bool aoa_start(libusb_device_handle* handle) {
+  TRACE_SCOPE("aoa_start");
   int rc = libusb_control_transfer(handle, USB_DIR_OUT | USB_TYPE_VENDOR, 53, 0, 0, nullptr, 0, 0);
   if (rc < 0) {
     error("failed to start AoA: %s", libusb_error_name(rc));
@@ -173,11 +256,13 @@ static void attach_usb_interface(libusb_device_handle* handle, int interface) {
 
 static libusb_device_handle* open_device_timeout(std::vector<int> accepted_pids,
                                                  std::chrono::milliseconds timeout) {
+  TRACE_SCOPE("open_device_timeout");
   int rc;
   auto start = std::chrono::steady_clock::now();
 
   // TODO: Make this less dumb.
   while (std::chrono::steady_clock::now() - start < timeout) {
+    TRACE_INSTANT("poll devices");
     libusb_device** devices;
     ssize_t device_count = libusb_get_device_list(nullptr, &devices);
     Auto(libusb_free_device_list(devices, true));
@@ -360,15 +445,37 @@ bool AOADevice::spawn_accessory_threads() {
   attach_usb_interface(handle, interface_number);
 
   auto read_function = [this, source]() {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+    using seconds = std::chrono::duration<double>;
+
+    trace_set_thread_name("accessory read");
+    USBBuffer buffer(handle, 16384, use_dev_mem);
+    debug("accessory read buffer: %s", buffer.is_dev_mem() ? "usbfs" : "user memory");
+
+    // Keep track of the CPU it costs to move each MiB, to see what the buffer choice buys us. The
+    // data rate is just whatever the phone's encoder is producing, so it's only there for context:
+    // the stream never comes close to what the USB link can do, whichever buffers we use.
+    size_t bytes = 0;
+    auto last_report = std::chrono::steady_clock::now();
+    auto last_report_cpu_time = cpu_time(RUSAGE_THREAD);
+
     while (true) {
-      unsigned char buffer[16384];
       int transferred;
-      int rc = libusb_bulk_transfer(handle, source, buffer, sizeof(buffer), &transferred, 0);
+      TRACE_BEGIN("bulk transfer");
+      int rc =
+        libusb_bulk_transfer(handle, source, buffer.get(), buffer.size(), &transferred, 0);
       if (rc != 0) {
         fatal("failed to transfer data from AoA endpoint: %s", libusb_error_name(rc));
       }
+      TRACE_END("bulk transfer");
+
+      bytes += transferred;
+      if (accessory_record_fd >= 0) {
+        record(accessory_record_fd, buffer.get(), transferred);
+      }
 
-      const char* current = reinterpret_cast<char*>(buffer);
+      TRACE_BEGIN("socket write");
+      const char* current = reinterpret_cast<char*>(buffer.get());
       while (transferred > 0) {
         ssize_t written = write(accessory_internal_fd, current, transferred);
         if (written < 0) {
@@ -380,18 +487,34 @@ bool AOADevice::spawn_accessory_threads() {
         current += written;
         transferred -= written;
       }
+      TRACE_END("socket write");
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_report >= ACCESSORY_REPORT_INTERVAL) {
+        auto current_cpu_time = cpu_time(RUSAGE_THREAD);
+        double megabytes = bytes / (1024.0 * 1024.0);
+        double cpu = milliseconds(current_cpu_time - last_report_cpu_time).count();
+        info("accessory: %.1f ms CPU/MiB (%s), stream rate %.2f MiB/s",
+             megabytes > 0 ? cpu / megabytes : 0, buffer.is_dev_mem() ? "usbfs" : "user memory",
+             megabytes / seconds(now - last_report).count());
+
+        bytes = 0;
+        last_report = now;
+        last_report_cpu_time = current_cpu_time;
+      }
     }
   };
 
   auto write_function = [this, sink]() {
+    trace_set_thread_name("accessory write");
+    USBBuffer buffer(handle, 16384, use_dev_mem);
     while (true) {
-      char buffer[16384];
-      ssize_t bytes_read = read(accessory_internal_fd, buffer, sizeof(buffer));
+      ssize_t bytes_read = read(accessory_internal_fd, buffer.get(), buffer.size());
       if (bytes_read < 0) {
         fatal("read failed: %s", strerror(errno));
       }
 
-      unsigned char* current = reinterpret_cast<unsigned char*>(buffer);
+      unsigned char* current = buffer.get();
       while (bytes_read > 0) {
         int transferred;
         int rc = libusb_bulk_transfer(handle, sink, current, bytes_read, &transferred, 0);
@@ -420,11 +543,14 @@ struct audio_transfer_userdata {
   libusb_device_handle* handle;
   int endpoint;
   int fd;
+  int record_fd;
+  bool use_dev_mem;
 };
 
 static void audio_transfer_enqueue(struct libusb_transfer* transfer);
 
 static void audio_transfer_callback(struct libusb_transfer* transfer) {
+  TRACE_SCOPE("audio callback");
   auto userdata = static_cast<audio_transfer_userdata*>(transfer->user_data);
   switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED: {
@@ -454,6 +580,12 @@ static void audio_transfer_callback(struct libusb_transfer* transfer) {
         } else if (rc < bytes) {
           error("buffer overrun while writing audio");
         }
+
+        if (userdata->record_fd >= 0) {
+          for (ssize_t i = 0; i < iovs; ++i) {
+            record(userdata->record_fd, iov[i].iov_base, iov[i].iov_len);
+          }
+        }
       }
 
       audio_transfer_enqueue(transfer);
@@ -467,7 +599,7 @@ static void audio_transfer_callback(struct libusb_transfer* transfer) {
 }
 
 void audio_transfer_enqueue(struct libusb_transfer* transfer) {
-  static unsigned char* buffer;
+  static USBBuffer* buffer;
   static int packet_size;
 
   auto userdata = static_cast<audio_transfer_userdata*>(transfer->user_data);
@@ -478,11 +610,13 @@ void audio_transfer_enqueue(struct libusb_transfer* transfer) {
     if (packet_size < 0) {
       fatal("failed to get maximum isochronous packet size: %s", libusb_error_name(packet_size));
     }
-    buffer = new unsigned char[AUDIO_PACKET_BUFFER * packet_size]();
+    buffer = new USBBuffer(userdata->handle, AUDIO_PACKET_BUFFER * packet_size,
+                           userdata->use_dev_mem);
   }
 
-  libusb_fill_iso_transfer(transfer, userdata->handle, userdata->endpoint, buffer, sizeof(buffer),
-                           AUDIO_PACKET_BUFFER, audio_transfer_callback, userdata, 1000);
+  libusb_fill_iso_transfer(transfer, userdata->handle, userdata->endpoint, buffer->get(),
+                           buffer->size(), AUDIO_PACKET_BUFFER, audio_transfer_callback, userdata,
+                           1000);
   libusb_set_iso_packet_lengths(transfer, packet_size);
   libusb_submit_transfer(transfer);
 }
@@ -538,9 +672,13 @@ bool AOADevice::spawn_audio_threads() {
   }
 
   this->audio_read_thread = std::thread([this, source]() {
+    trace_set_thread_name("audio");
     libusb_transfer* transfer = libusb_alloc_transfer(AUDIO_PACKET_BUFFER);
-    auto userdata =
-      new audio_transfer_userdata{.handle = handle, .endpoint = source, .fd = audio_internal_fd };
+    auto userdata = new audio_transfer_userdata{.handle = handle,
+                                                 .endpoint = source,
+                                                 .fd = audio_internal_fd,
+                                                 .record_fd = audio_record_fd,
+                                                 .use_dev_mem = use_dev_mem };
     transfer->user_data = userdata;
     audio_transfer_enqueue(transfer);
     while (true) {
@@ -7,17 +7,7 @@
 
 #include <libusb.h>
 
-#define _log(fmt, prefix, ...) fprintf(stderr, prefix fmt "\n", ##__VA_ARGS__)
-#define log(fmt, ...) _log(fmt, "", ##__VA_ARGS__)
-#define debug(fmt, ...) _log(fmt, "debug: ", ##__VA_ARGS__)
-#define info(fmt, ...) _log(fmt, "info: ", ##__VA_ARGS__)
-#define warn(fmt, ...) _log(fmt, "warning: ", ##__VA_ARGS__)
-#define error(fmt, ...) _log(fmt, "error: ", ##__VA_ARGS__)
-#define fatal(...) \
-  do {                  \
-    error(__VA_ARGS__); \
-    exit(1);            \
-  } while (false)
+#include "log.h"
 
 enum class AOAMode {
   accessory = 1 << 0,
@@ -31,15 +21,18 @@ class AOADevice {
  private:
   libusb_device_handle* handle = nullptr;
   AOAMode mode = AOAMode(0);
+  bool use_dev_mem = true;
   std::thread accessory_read_thread;
   std::thread accessory_write_thread;
   int accessory_internal_fd = -1;
   int accessory_external_fd = -1;
+  int accessory_record_fd = -1;
 
   std::thread audio_read_thread;
   std::thread audio_write_thread;
   int audio_internal_fd = -1;
   int audio_external_fd = -1;
+  int audio_record_fd = -1;
 
   AOADevice(libusb_device_handle* handle, AOAMode mode);
 
@@ -49,6 +42,17 @@ class AOADevice {
   bool initialize();
   static std::unique_ptr<AOADevice> open(AOAMode mode);
 
+  // Allocate transfer buffers from usbfs's mmapped memory, when the kernel supports it.
+  void set_use_dev_mem(bool enabled) {
+    use_dev_mem = enabled;
+  }
+
+  // Also write everything received from the device to these (for mimic-bench), if not -1.
+  void set_record_fds(int accessory_fd, int audio_fd) {
+    accessory_record_fd = accessory_fd;
+    audio_record_fd = audio_fd;
+  }
+
   int get_accessory_fd() {
     return accessory_external_fd;
   }
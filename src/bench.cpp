@@ -0,0 +1,399 @@
+// Benchmark candidate decode pipelines against recorded streams (see mimic -R), headlessly.
+//
+// Each configuration runs in its own process, so that its CPU usage and peak memory can be measured
+// in isolation, and so that a decoder that falls over can't take the rest of the run with it.
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "cpu_time.h"
+#include "decoder_cache.h"
+#include "log.h"
+
+// StreamService encodes at 30fps (see getFrameRate()), so that's the rate recorded streams get
+// played back at.
+constexpr double DEFAULT_CAPTURE_FPS = 30;
+
+// A run that goes this long without a buffer reaching the sink is killed, so that a hardware
+// decoder that wedges without a working device can't hang the whole benchmark.
+constexpr unsigned STALL_TIMEOUT_SECONDS = 10;
+
+static const std::vector<std::string> DEFAULT_VIDEO_DECODERS = {
+  "avdec_h264",
+  "avdec_h264 max-threads=1",
+  "avdec_h264 max-threads=2",
+  "avdec_h264 max-threads=4",
+  "openh264dec",
+  "vaapih264dec",
+  "v4l2h264dec",
+  "nvh264dec",
+};
+
+static const std::vector<std::string> DEFAULT_AUDIO_DECODERS = {
+  "audioconvert",
+  "audioconvert ! audioresample",
+};
+
+// What a benchmark process reports back to its parent.
+struct DecodeStats {
+  bool available;
+  char error[256];
+  size_t frames;
+  double seconds;
+  double latency_mean_ms;
+  double latency_p95_ms;
+  double cpu_ms;
+};
+
+// Timestamps buffers as they go into the decoder, and again as they hit the sink, matching them up
+// by PTS, so that a decoder dropping a frame doesn't throw off every measurement after it.
+class LatencyProbe {
+ private:
+  using clock = std::chrono::steady_clock;
+
+  std::mutex mutex;
+  std::map<GstClockTime, clock::time_point> pending;
+  std::vector<double> latencies;
+  size_t frames = 0;
+
+ public:
+  void attach(GstElement* parse, GstElement* sink) {
+    GstPad* parse_src = gst_element_get_static_pad(parse, "src");
+    gst_pad_add_probe(parse_src, GST_PAD_PROBE_TYPE_BUFFER, decoder_input, this, nullptr);
+    gst_object_unref(parse_src);
+
+    GstPad* sink_sink = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_sink, GST_PAD_PROBE_TYPE_BUFFER, decoder_output, this, nullptr);
+    gst_object_unref(sink_sink);
+  }
+
+  void summarize(DecodeStats& stats) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.frames = frames;
+    if (latencies.empty()) {
+      return;
+    }
+
+    double total = 0;
+    for (double latency : latencies) {
+      total += latency;
+    }
+    stats.latency_mean_ms = total / latencies.size();
+
+    std::sort(latencies.begin(), latencies.end());
+    stats.latency_p95_ms = latencies[latencies.size() * 95 / 100];
+  }
+
+ private:
+  static GstPadProbeReturn decoder_input(GstPad*, GstPadProbeInfo* info, gpointer userdata) {
+    auto probe = static_cast<LatencyProbe*>(userdata);
+    auto now = clock::now();
+    GstClockTime pts = GST_BUFFER_PTS(gst_pad_probe_info_get_buffer(info));
+    if (GST_CLOCK_TIME_IS_VALID(pts)) {
+      std::lock_guard<std::mutex> lock(probe->mutex);
+      probe->pending.emplace(pts, now);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  static GstPadProbeReturn decoder_output(GstPad*, GstPadProbeInfo* info, gpointer userdata) {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    auto probe = static_cast<LatencyProbe*>(userdata);
+    auto now = clock::now();
+    GstClockTime pts = GST_BUFFER_PTS(gst_pad_probe_info_get_buffer(info));
+    alarm(STALL_TIMEOUT_SECONDS);
+
+    std::lock_guard<std::mutex> lock(probe->mutex);
+    ++probe->frames;
+    if (!GST_CLOCK_TIME_IS_VALID(pts)) {
+      return GST_PAD_PROBE_OK;
+    }
+
+    auto it = probe->pending.find(pts);
+    if (it != probe->pending.end()) {
+      probe->latencies.push_back(milliseconds(now - it->second).count());
+    }
+
+    // Screen capture streams don't have B-frames, so anything older than this was dropped.
+    probe->pending.erase(probe->pending.begin(), probe->pending.upper_bound(pts));
+    return GST_PAD_PROBE_OK;
+  }
+};
+
+static void run_pipeline(const std::string& description, DecodeStats& stats) {
+  gst_init(nullptr, nullptr);
+
+  // The default action of SIGALRM kills us, and the parent reports it. Every buffer that reaches
+  // the sink pushes the deadline back.
+  alarm(STALL_TIMEOUT_SECONDS);
+
+  GError* err = nullptr;
+  GstElement* pipeline = gst_parse_launch(description.c_str(), &err);
+  if (err) {
+    snprintf(stats.error, sizeof(stats.error), "%s", err->message);
+    return;
+  }
+
+  GstElement* parse = gst_bin_get_by_name(GST_BIN(pipeline), "parse");
+  GstElement* sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+  LatencyProbe probe;
+  probe.attach(parse, sink);
+
+  auto start = std::chrono::steady_clock::now();
+  auto start_cpu_time = cpu_time(RUSAGE_SELF);
+  if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    snprintf(stats.error, sizeof(stats.error), "failed to start pipeline");
+    return;
+  }
+
+  GstBus* bus = gst_element_get_bus(pipeline);
+  GstMessage* message = gst_bus_timed_pop_filtered(
+    bus, GST_CLOCK_TIME_NONE, GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+  auto end = std::chrono::steady_clock::now();
+  auto end_cpu_time = cpu_time(RUSAGE_SELF);
+  alarm(0);
+
+  if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+    GError* message_error;
+    gst_message_parse_error(message, &message_error, nullptr);
+    snprintf(stats.error, sizeof(stats.error), "%s", message_error->message);
+    return;
+  }
+
+  stats.available = true;
+  stats.seconds = std::chrono::duration<double>(end - start).count();
+  stats.cpu_ms = std::chrono::duration<double, std::milli>(end_cpu_time - start_cpu_time).count();
+  probe.summarize(stats);
+}
+
+// Run a pipeline in a child process, returning whether it could run at all.
+static bool benchmark(const std::string& name, const std::string& description, DecodeStats& stats,
+                      long& peak_rss_kb) {
+  int pfd[2];
+  if (pipe(pfd) != 0) {
+    fatal("failed to create pipe: %s", strerror(errno));
+  }
+
+  // Don't let the child inherit anything we haven't printed yet.
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fatal("fork failed: %s", strerror(errno));
+  }
+
+  if (pid == 0) {
+    close(pfd[0]);
+    DecodeStats stats = {};
+    run_pipeline(description, stats);
+    if (write(pfd[1], &stats, sizeof(stats)) != sizeof(stats)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(pfd[1]);
+  stats = {};
+  ssize_t bytes_read = read(pfd[0], &stats, sizeof(stats));
+  close(pfd[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    fatal("wait4 failed: %s", strerror(errno));
+  }
+
+  if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+    printf("%-40s unavailable: timed out, nothing decoded for %u s\n", name.c_str(),
+           STALL_TIMEOUT_SECONDS);
+    return false;
+  } else if (bytes_read != sizeof(stats)) {
+    printf("%-40s crashed (status %#x)\n", name.c_str(), status);
+    return false;
+  } else if (!stats.available) {
+    printf("%-40s unavailable: %s\n", name.c_str(), stats.error);
+    return false;
+  } else if (stats.frames == 0) {
+    printf("%-40s unavailable: no frames decoded\n", name.c_str());
+    return false;
+  }
+
+  peak_rss_kb = usage.ru_maxrss;
+  return true;
+}
+
+static double cpu_percent(const DecodeStats& stats) {
+  return stats.cpu_ms / (stats.seconds * 10);
+}
+
+// Throughput is measured by decoding the capture as fast as possible. Latency and CPU usage are
+// measured separately with the capture played back in real time, since a decoder that's being fed
+// faster than it can keep up with will have frames queued up in front of it.
+static bool benchmark_video(const char* path, double capture_fps, DecoderBenchmark& result) {
+  char caps[128];
+  snprintf(caps, sizeof(caps), "video/x-h264,stream-format=byte-stream,framerate=%.0f/1",
+           capture_fps);
+  std::string source = std::string("filesrc location=\"") + path + "\" ! " + caps + " ! ";
+  std::string sink = " ! " + result.decoder + " ! fakesink name=sink sync=false";
+
+  std::string throughput_description = source + "h264parse name=parse" + sink;
+  std::string paced_description = source + "h264parse ! identity sync=true name=parse" + sink;
+
+  DecodeStats throughput, paced;
+  long throughput_rss_kb, paced_rss_kb;
+  debug("benchmarking '%s'", throughput_description.c_str());
+  if (!benchmark(result.decoder, throughput_description, throughput, throughput_rss_kb)) {
+    return false;
+  }
+
+  debug("benchmarking '%s'", paced_description.c_str());
+  if (!benchmark(result.decoder, paced_description, paced, paced_rss_kb)) {
+    return false;
+  }
+
+  result.fps = throughput.frames / throughput.seconds;
+  result.latency_mean_ms = paced.latency_mean_ms;
+  result.latency_p95_ms = paced.latency_p95_ms;
+  result.cpu_percent = cpu_percent(paced);
+  result.peak_rss_kb = std::max(throughput_rss_kb, paced_rss_kb);
+  return true;
+}
+
+static bool benchmark_audio(const char* path, DecoderBenchmark& result) {
+  std::string description = std::string("filesrc location=\"") + path +
+                            "\" ! rawaudioparse format=pcm pcm-format=s16le "
+                            "sample-rate=44100 num-channels=2 name=parse ! " +
+                            result.decoder + " ! fakesink name=sink sync=false";
+  DecodeStats stats;
+  debug("benchmarking '%s'", description.c_str());
+  if (!benchmark(result.decoder, description, stats, result.peak_rss_kb)) {
+    return false;
+  }
+
+  result.fps = stats.frames / stats.seconds;
+  result.latency_mean_ms = stats.latency_mean_ms;
+  result.latency_p95_ms = stats.latency_p95_ms;
+  result.cpu_percent = cpu_percent(stats);
+  return true;
+}
+
+static void print_result(const DecoderBenchmark& result) {
+  printf("%-40s %9.1f %9.2f %9.2f %6.0f%% %7ld KiB\n", result.decoder.c_str(), result.fps,
+         result.latency_mean_ms, result.latency_p95_ms, result.cpu_percent, result.peak_rss_kb);
+}
+
+static void print_header(const char* kind) {
+  printf("%-40s %9s %9s %9s %7s %11s\n", kind, "fps", "mean ms", "p95 ms", "CPU", "peak RSS");
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [OPTIONS] CAPTURE.h264 [DECODER...]\n", argv0);
+  fprintf(stderr, "  -a PCM     also benchmark audio pipelines against a 44.1kHz S16LE capture\n");
+  fprintf(stderr, "  -f FPS     frame rate a decoder must sustain to be picked [%.0f]\n",
+          DECODER_MIN_FPS);
+  fprintf(stderr, "  -o PATH    where to cache the results [%s]\n", decoder_cache_path().c_str());
+  fprintf(stderr, "  -r FPS     frame rate to play the capture back at [%.0f]\n",
+          DEFAULT_CAPTURE_FPS);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  const char* audio_path = nullptr;
+  double min_fps = DECODER_MIN_FPS;
+  double capture_fps = DEFAULT_CAPTURE_FPS;
+  std::string cache_path = decoder_cache_path();
+
+  int c;
+  while ((c = getopt(argc, argv, "a:f:o:r:")) != -1) {
+    switch (c) {
+      case 'a':
+        audio_path = optarg;
+        break;
+
+      case 'f':
+        min_fps = atof(optarg);
+        break;
+
+      case 'o':
+        cache_path = optarg;
+        break;
+
+      case 'r':
+        capture_fps = atof(optarg);
+        if (capture_fps <= 0) {
+          usage(argv[0]);
+        }
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+  }
+
+  const char* video_path = argv[optind++];
+  std::vector<std::string> video_decoders(argv + optind, argv + argc);
+  if (video_decoders.empty()) {
+    video_decoders = DEFAULT_VIDEO_DECODERS;
+  }
+
+  std::vector<DecoderBenchmark> results;
+  print_header("video decoder");
+  for (const std::string& decoder : video_decoders) {
+    DecoderBenchmark result;
+    result.decoder = decoder;
+    if (benchmark_video(video_path, capture_fps, result)) {
+      print_result(result);
+      results.push_back(result);
+    }
+  }
+
+  // Audio is raw PCM, so there's nothing to choose between, but it's useful to know what the
+  // conversion costs.
+  if (audio_path) {
+    printf("\n");
+    print_header("audio pipeline");
+    for (const std::string& decoder : DEFAULT_AUDIO_DECODERS) {
+      DecoderBenchmark result;
+      result.decoder = decoder;
+      if (benchmark_audio(audio_path, result)) {
+        print_result(result);
+      }
+    }
+  }
+
+  const DecoderBenchmark* best = decoder_pick_best(results, min_fps);
+  if (!best) {
+    fatal("no video decoders available");
+  }
+
+  printf("\nbest video decoder: %s\n", best->decoder.c_str());
+  if (!decoder_cache_store(cache_path, results, min_fps)) {
+    return 1;
+  }
+
+  info("cached results in '%s'", cache_path.c_str());
+  return 0;
+}
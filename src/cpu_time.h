@@ -0,0 +1,52 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "log.h"
+
+// User and system CPU time consumed by who (RUSAGE_SELF, RUSAGE_THREAD).
+static inline std::chrono::microseconds cpu_time(int who) {
+  struct rusage usage;
+  if (getrusage(who, &usage) != 0) {
+    fatal("getrusage failed: %s", strerror(errno));
+  }
+
+  auto to_duration = [](const struct timeval& tv) {
+    return std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+  };
+  return to_duration(usage.ru_utime) + to_duration(usage.ru_stime);
+}
+
+// User and system CPU time consumed by another process, or zero if it doesn't exist (anymore).
+static inline std::chrono::microseconds process_cpu_time(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return std::chrono::microseconds::zero();
+  }
+
+  char stat[1024];
+  size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[length] = '\0';
+
+  // The command name can contain spaces and parentheses, so skip past the last ')'. utime and stime
+  // are the 14th and 15th fields, in clock ticks (see proc(5)).
+  const char* fields = strrchr(stat, ')');
+  unsigned long utime, stime;
+  if (!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+                        &stime) != 2) {
+    return std::chrono::microseconds::zero();
+  }
+
+  long ticks_per_second = sysconf(_SC_CLK_TCK);
+  return std::chrono::microseconds((utime + stime) * 1000000 / ticks_per_second);
+}
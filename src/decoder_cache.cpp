@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "auto.h"
+#include "decoder_cache.h"
+#include "log.h"
+
+constexpr char CACHE_HEADER[] = "# mimic decoder benchmark v2";
+
+static std::string cache_directory() {
+  const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+  if (xdg_cache_home && xdg_cache_home[0] != '\0') {
+    return std::string(xdg_cache_home) + "/mimic";
+  }
+
+  const char* home = getenv("HOME");
+  if (!home) {
+    home = "";
+  }
+  return std::string(home) + "/.cache/mimic";
+}
+
+std::string decoder_cache_path() {
+  return cache_directory() + "/decoders";
+}
+
+bool decoder_cache_load(const std::string& path, std::vector<DecoderBenchmark>& results,
+                        double& min_fps) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    if (errno != ENOENT) {
+      error("failed to open decoder cache '%s': %s", path.c_str(), strerror(errno));
+    }
+    return false;
+  }
+  Auto(fclose(file));
+
+  char line[1024];
+  if (!fgets(line, sizeof(line), file) || strncmp(line, CACHE_HEADER, strlen(CACHE_HEADER)) != 0) {
+    warn("ignoring decoder cache '%s' with unknown format, rerun mimic-bench", path.c_str());
+    return false;
+  }
+
+  if (!fgets(line, sizeof(line), file) || sscanf(line, "min_fps %lf", &min_fps) != 1) {
+    warn("ignoring decoder cache '%s' without a frame rate threshold", path.c_str());
+    return false;
+  }
+
+  // Each line is "fps latency_mean latency_p95 cpu_percent peak_rss decoder...".
+  while (fgets(line, sizeof(line), file)) {
+    DecoderBenchmark result;
+    int decoder_offset = 0;
+    int rc = sscanf(line, "%lf %lf %lf %lf %ld %n", &result.fps, &result.latency_mean_ms,
+                    &result.latency_p95_ms, &result.cpu_percent, &result.peak_rss_kb,
+                    &decoder_offset);
+    if (rc != 5 || decoder_offset == 0) {
+      warn("ignoring malformed line in decoder cache '%s'", path.c_str());
+      continue;
+    }
+
+    result.decoder = line + decoder_offset;
+    while (!result.decoder.empty() && result.decoder.back() == '\n') {
+      result.decoder.pop_back();
+    }
+
+    if (!result.decoder.empty()) {
+      results.push_back(result);
+    }
+  }
+
+  return true;
+}
+
+bool decoder_cache_store(const std::string& path, const std::vector<DecoderBenchmark>& results,
+                         double min_fps) {
+  // Only bother creating the default directory, anyone passing their own path can do it themselves.
+  if (path == decoder_cache_path()) {
+    std::string directory = cache_directory();
+    std::string parent = directory.substr(0, directory.rfind('/'));
+    mkdir(parent.c_str(), 0755);
+    mkdir(directory.c_str(), 0755);
+  }
+
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    error("failed to open decoder cache '%s': %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  fprintf(file, "%s\n", CACHE_HEADER);
+  fprintf(file, "min_fps %.2f\n", min_fps);
+  for (const DecoderBenchmark& result : results) {
+    fprintf(file, "%.2f %.3f %.3f %.1f %ld %s\n", result.fps, result.latency_mean_ms,
+            result.latency_p95_ms, result.cpu_percent, result.peak_rss_kb, result.decoder.c_str());
+  }
+
+  if (fclose(file) != 0) {
+    error("failed to write decoder cache '%s': %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+const DecoderBenchmark* decoder_pick_best(const std::vector<DecoderBenchmark>& results,
+                                          double min_fps) {
+  const DecoderBenchmark* best = nullptr;
+  for (const DecoderBenchmark& result : results) {
+    if (result.fps < min_fps) {
+      continue;
+    }
+
+    if (!best || result.latency_mean_ms < best->latency_mean_ms ||
+        (result.latency_mean_ms == best->latency_mean_ms &&
+         result.cpu_percent < best->cpu_percent)) {
+      best = &result;
+    }
+  }
+
+  if (best) {
+    return best;
+  }
+
+  for (const DecoderBenchmark& result : results) {
+    if (!best || result.fps > best->fps) {
+      best = &result;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Results of running a recorded stream through one video decoder configuration, as measured by
+// mimic-bench, and cached so that mimic can pick the best one at startup.
+struct DecoderBenchmark {
+  // The decode stage of the pipeline as a gst-launch description, e.g. "avdec_h264 max-threads=2".
+  std::string decoder;
+
+  double fps;
+  double latency_mean_ms;
+  double latency_p95_ms;
+  double cpu_percent;
+  long peak_rss_kb;
+};
+
+// Frame rate a decoder needs to sustain to be picked, unless mimic-bench was told otherwise.
+// StreamService encodes at 30fps (see getFrameRate()), so a decoder at least has to keep up with
+// that.
+constexpr double DECODER_MIN_FPS = 30;
+
+// $XDG_CACHE_HOME/mimic/decoders, or ~/.cache/mimic/decoders.
+std::string decoder_cache_path();
+
+// The cache also records the min_fps the benchmark was run with, so that mimic picks the same
+// decoder that mimic-bench did.
+bool decoder_cache_load(const std::string& path, std::vector<DecoderBenchmark>& results,
+                        double& min_fps);
+bool decoder_cache_store(const std::string& path, const std::vector<DecoderBenchmark>& results,
+                         double min_fps);
+
+// Pick the decoder with the lowest latency out of the ones that can keep up with min_fps, using CPU
+// usage to break ties. If none of them can keep up, pick the fastest.
+const DecoderBenchmark* decoder_pick_best(const std::vector<DecoderBenchmark>& results,
+                                          double min_fps);
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,10 +10,20 @@
 #include <unistd.h>
 
 #include <chrono>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "aoa.h"
 #include "chrono_literals.h"
+#include "decoder_cache.h"
+#include "trace.h"
+#include "video_scheduler.h"
+
+#ifndef M3_CROSS
+// Used when mimic-bench hasn't picked anything better.
+constexpr char DEFAULT_VIDEO_DECODER[] = "avdec_h264";
+#endif
 
 static pid_t video_pid = -1;
 static pid_t audio_pid = -1;
@@ -28,23 +39,51 @@ static void reap() {
   }
 }
 
-static void exec_gstreamer(int accessory_fd, int audio_fd) {
+// gst-launch escapes whitespace within each of its arguments, so a decoder with properties (e.g.
+// "avdec_h264 max-threads=2") needs to be passed as separate arguments.
+static std::vector<std::string> split_arguments(const std::string& description) {
+  std::vector<std::string> result;
+  size_t begin = description.find_first_not_of(" \t");
+  while (begin != std::string::npos) {
+    size_t end = description.find_first_of(" \t", begin);
+    result.push_back(description.substr(begin, end - begin));
+    begin = description.find_first_not_of(" \t", end);
+  }
+  return result;
+}
+
+static void exec_gstreamer(int video_fd, int audio_fd, const std::string& video_decoder) {
   atexit(reap);
 
+#ifndef M3_CROSS
+  // Build the command line before forking, to avoid allocating in the child.
+  std::vector<std::string> video_args = { "gst-launch-1.0", "fdsrc", "!", "h264parse", "!" };
+  std::vector<std::string> decoder_args = split_arguments(video_decoder);
+  video_args.insert(video_args.end(), decoder_args.begin(), decoder_args.end());
+  video_args.insert(video_args.end(), { "!", "autovideosink", "sync=false" });
+
+  std::vector<char*> video_argv;
+  for (std::string& arg : video_args) {
+    video_argv.push_back(&arg[0]);
+  }
+  video_argv.push_back(nullptr);
+#endif
+
   video_pid = fork();
   if (video_pid < 0) {
     fatal("video fork failed: %s", strerror(errno));
   }
 
   if (video_pid == 0) {
-    dup2(accessory_fd, STDIN_FILENO);
+    dup2(video_fd, STDIN_FILENO);
+    trace_restore_signal_mask();
 #ifdef M3_CROSS
+    (void)video_decoder;
     execlp("gst-launch", "gst-launch", "fdsrc", "!",
            "video/x-h264,width=800,height=480,framerate=60/1", "!", "vpudec", "!", "mfw_v4lsink",
            "sync=false", nullptr);
 #else
-    execlp("gst-launch-1.0", "gst-launch-1.0", "fdsrc", "!", "h264parse", "!", "avdec_h264", "!",
-           "autovideosink", "sync=false", nullptr);
+    execvp(video_argv[0], video_argv.data());
 #endif
     fatal("exec failed: %s", strerror(errno));
   }
@@ -56,6 +95,7 @@ static void exec_gstreamer(int accessory_fd, int audio_fd) {
 
   if (audio_pid == 0) {
     dup2(audio_fd, STDIN_FILENO);
+    trace_restore_signal_mask();
     execlp("gst-launch-0.10", "gst-launch-0.10", "fdsrc", "!",
            "audio/x-raw-int,width=16,depth=16,endianness=1234,channels=2,rate=44100,signed=true",
            "!", "audioconvert", "!", "autoaudiosink", "sync=false", nullptr);
@@ -76,22 +116,131 @@ static void wait_for_exit() {
   audio_pid = -1;
 }
 
+#ifndef M3_CROSS
+static std::string pick_video_decoder() {
+  std::string path = decoder_cache_path();
+  std::vector<DecoderBenchmark> results;
+  double min_fps;
+  if (decoder_cache_load(path, results, min_fps)) {
+    const DecoderBenchmark* best = decoder_pick_best(results, min_fps);
+    if (best) {
+      info("using video decoder '%s' from %s", best->decoder.c_str(), path.c_str());
+      return best->decoder;
+    }
+  }
+  return DEFAULT_VIDEO_DECODER;
+}
+#endif
+
+static int open_recording(const std::string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fatal("failed to open '%s': %s", path.c_str(), strerror(errno));
+  }
+  return fd;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [OPTIONS]\n", argv0);
+  fprintf(stderr, "  -n         present video frames as soon as they arrive\n");
+  fprintf(stderr, "  -s FACTOR  jitter buffer size, in multiples of the measured jitter [2.0]\n");
+  fprintf(stderr, "  -l MS      maximum latency added by the jitter buffer [50]\n");
+  fprintf(stderr, "  -M         don't use usbfs mapped memory for USB transfers\n");
+  fprintf(stderr, "  -t PATH    trace the data path, dumping to PATH at exit and on SIGUSR1\n");
+  fprintf(stderr, "  -d DECODER video decoder, instead of the best one found by mimic-bench\n");
+  fprintf(stderr, "  -R PREFIX  record streams to PREFIX.h264 and PREFIX.pcm, for mimic-bench\n");
+  exit(1);
+}
+
 int main(int argc, char* argv[]) {
+  VideoSchedulerOptions scheduler_options;
+  bool use_dev_mem = true;
+  const char* trace_path = nullptr;
+  const char* video_decoder = nullptr;
+  const char* record_prefix = nullptr;
+
+  int c;
+  while ((c = getopt(argc, argv, "ns:l:Mt:d:R:")) != -1) {
+    switch (c) {
+      case 'n':
+        scheduler_options.pace_frames = false;
+        break;
+
+      case 's':
+        scheduler_options.smoothness = atof(optarg);
+        break;
+
+      case 'l':
+        scheduler_options.max_latency = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+      case 'M':
+        use_dev_mem = false;
+        break;
+
+      case 't':
+        trace_path = optarg;
+        break;
+
+      case 'd':
+        video_decoder = optarg;
+        break;
+
+      case 'R':
+        record_prefix = optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (trace_path) {
+    trace_start(trace_path);
+  }
+
   std::unique_ptr<AOADevice> device;
   while (!device) {
     std::this_thread::sleep_for(100ms);
     device = AOADevice::open(AOAMode::accessory | AOAMode::audio);
   }
 
+  device->set_use_dev_mem(use_dev_mem);
+  if (record_prefix) {
+    std::string prefix = record_prefix;
+    device->set_record_fds(open_recording(prefix + ".h264"), open_recording(prefix + ".pcm"));
+  }
+
   if (!device->initialize()) {
     fatal("failed to initialize device");
   }
 
-  int accessory_fd = device->get_accessory_fd();
+  int video_fd = device->get_accessory_fd();
   int audio_fd = device->get_audio_fd();
 
-  exec_gstreamer(accessory_fd, audio_fd);
+  // Stick the scheduler between the accessory and the video sink.
+  int pfd[2];
+  if (pipe2(pfd, O_CLOEXEC) != 0) {
+    fatal("failed to create pipe: %s", strerror(errno));
+  }
+
+  VideoScheduler scheduler(video_fd, pfd[1], scheduler_options);
+  scheduler.start();
+  video_fd = pfd[0];
+
+#ifdef M3_CROSS
+  // The M3 always decodes on its VPU, so there's nothing to pick.
+  if (video_decoder) {
+    warn("ignoring video decoder '%s', the M3 always uses vpudec", video_decoder);
+  }
+  exec_gstreamer(video_fd, audio_fd, "");
+#else
+  exec_gstreamer(video_fd, audio_fd, video_decoder ? video_decoder : pick_video_decoder());
+#endif
+  scheduler.set_decoder_pid(video_pid);
   wait_for_exit();
 
-  return 0;
+  // The scheduler and the device still have threads blocked on the accessory, and destroying them
+  // while they're joinable would abort, so exit without unwinding.
+  exit(0);
 }
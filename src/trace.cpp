@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "trace.h"
+
+// Number of events each thread keeps around. Older events are overwritten.
+constexpr size_t TRACE_BUFFER_EVENTS = 1 << 16;
+
+std::atomic<bool> trace_enabled_flag(false);
+
+struct TraceEvent {
+  std::chrono::steady_clock::time_point timestamp;
+  const char* name;
+  TracePhase phase;
+};
+
+struct TraceBuffer {
+  pid_t tid;
+  std::atomic<const char*> thread_name{ nullptr };
+
+  // Only ever written by the owning thread. Readers can see events that are being overwritten
+  // torn, which is fine for a debugging aid, but they never see events that haven't been written.
+  std::atomic<uint64_t> count{ 0 };
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+static std::mutex trace_buffers_mutex;
+static std::vector<TraceBuffer*> trace_buffers;
+static const char* trace_path;
+static sigset_t trace_original_signal_mask;
+
+// Dumps can come from the SIGUSR1 thread and from exit at the same time.
+static std::mutex trace_dump_mutex;
+
+static thread_local TraceBuffer* current_trace_buffer;
+
+static TraceBuffer* get_trace_buffer() {
+  if (!current_trace_buffer) {
+    // These are deliberately leaked, so that the events of threads that have exited still show up.
+    current_trace_buffer = new TraceBuffer();
+    current_trace_buffer->tid = syscall(SYS_gettid);
+
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    trace_buffers.push_back(current_trace_buffer);
+  }
+  return current_trace_buffer;
+}
+
+void trace_record(const char* name, TracePhase phase) {
+  TraceBuffer* buffer = get_trace_buffer();
+  uint64_t index = buffer->count.load(std::memory_order_relaxed);
+  TraceEvent& event = buffer->events[index % TRACE_BUFFER_EVENTS];
+  event.timestamp = std::chrono::steady_clock::now();
+  event.name = name;
+  event.phase = phase;
+  buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void trace_set_thread_name(const char* name) {
+  if (trace_enabled()) {
+    get_trace_buffer()->thread_name.store(name, std::memory_order_relaxed);
+  }
+}
+
+// Must be called with trace_dump_mutex held.
+static bool trace_write() {
+  using microseconds = std::chrono::duration<double, std::micro>;
+
+  FILE* file = fopen(trace_path, "w");
+  if (!file) {
+    error("failed to open trace file '%s': %s", trace_path, strerror(errno));
+    return false;
+  }
+
+  pid_t pid = getpid();
+  fprintf(file, "{\"traceEvents\":[");
+
+  const char* separator = "\n";
+  std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+  for (TraceBuffer* buffer : trace_buffers) {
+    const char* thread_name = buffer->thread_name.load(std::memory_order_relaxed);
+    if (thread_name) {
+      fprintf(file,
+              "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s\"}}",
+              separator, pid, buffer->tid, thread_name);
+      separator = ",\n";
+    }
+
+    uint64_t end = buffer->count.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+    for (uint64_t i = begin; i < end; ++i) {
+      const TraceEvent& event = buffer->events[i % TRACE_BUFFER_EVENTS];
+      double timestamp = microseconds(event.timestamp.time_since_epoch()).count();
+      fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+              separator, event.name, static_cast<char>(event.phase), timestamp, pid, buffer->tid,
+              event.phase == TracePhase::instant ? ",\"s\":\"t\"" : "");
+      separator = ",\n";
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  if (fclose(file) != 0) {
+    error("failed to write trace file '%s': %s", trace_path, strerror(errno));
+    return false;
+  }
+
+  info("wrote trace to '%s'", trace_path);
+  return true;
+}
+
+bool trace_dump() {
+  std::lock_guard<std::mutex> lock(trace_dump_mutex);
+  return trace_write();
+}
+
+void trace_restore_signal_mask() {
+  if (trace_enabled()) {
+    pthread_sigmask(SIG_SETMASK, &trace_original_signal_mask, nullptr);
+  }
+}
+
+void trace_start(const char* path) {
+  trace_path = path;
+  trace_enabled_flag.store(true);
+  trace_set_thread_name("main");
+
+  atexit([]() {
+    // Never let go of the lock, so that a dump triggered by SIGUSR1 can't start truncating the file
+    // while we're exiting.
+    trace_dump_mutex.lock();
+    trace_write();
+  });
+
+  // Block the signals we care about so that every thread spawned after this inherits the mask, and
+  // the dump thread is the only one that will ever receive them. SIGINT and SIGTERM would otherwise
+  // kill us without running the atexit handlers, and the trace would be lost.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  int rc = pthread_sigmask(SIG_BLOCK, &mask, &trace_original_signal_mask);
+  if (rc != 0) {
+    fatal("failed to block signals: %s", strerror(rc));
+  }
+
+  std::thread([mask]() {
+    while (true) {
+      int signal;
+      int rc = sigwait(&mask, &signal);
+      if (rc != 0) {
+        fatal("sigwait failed: %s", strerror(rc));
+      }
+
+      if (signal == SIGUSR1) {
+        trace_dump();
+        continue;
+      }
+
+      // The atexit handlers run in reverse order of registration, so the children get reaped
+      // before the handler above writes out the trace.
+      info("received %s, exiting", strsignal(signal));
+      exit(128 + signal);
+    }
+  }).detach();
+
+  info("tracing to '%s', send SIGUSR1 to dump", path);
+}
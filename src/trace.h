@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+
+#include "auto.h"
+
+// Opt-in event tracing for the data path, dumped in Chrome's trace event format, which can be
+// loaded into chrome://tracing or https://ui.perfetto.dev.
+//
+// Each thread records into its own ring buffer, so recording an event takes no locks. When tracing
+// is disabled, every trace point is a single relaxed load and a branch.
+
+enum class TracePhase : char {
+  begin = 'B',
+  end = 'E',
+  instant = 'i',
+};
+
+extern std::atomic<bool> trace_enabled_flag;
+
+static inline bool trace_enabled() {
+  return trace_enabled_flag.load(std::memory_order_relaxed);
+}
+
+// name must be a string literal, or otherwise live forever.
+void trace_record(const char* name, TracePhase phase);
+void trace_set_thread_name(const char* name);
+
+// Enable tracing, dumping to path at exit, or whenever we receive SIGUSR1. SIGINT and SIGTERM are
+// turned into an orderly exit, so that they dump as well.
+// This must be called before any other threads are spawned.
+void trace_start(const char* path);
+
+// Write out everything that's currently in the trace buffers.
+bool trace_dump();
+
+// Undo the signal mask set up by trace_start, in a child that's about to exec.
+void trace_restore_signal_mask();
+
+#define TRACE_BEGIN(name)                         \
+  do {                                            \
+    if (trace_enabled()) {                        \
+      trace_record((name), TracePhase::begin);    \
+    }                                             \
+  } while (false)
+
+#define TRACE_END(name)                           \
+  do {                                            \
+    if (trace_enabled()) {                        \
+      trace_record((name), TracePhase::end);      \
+    }                                             \
+  } while (false)
+
+#define TRACE_INSTANT(name)                       \
+  do {                                            \
+    if (trace_enabled()) {                        \
+      trace_record((name), TracePhase::instant);  \
+    }                                             \
+  } while (false)
+
+// Trace the rest of the enclosing scope.
+class TraceScope {
+ private:
+  const char* name;
+  bool active;
+
+ public:
+  explicit TraceScope(const char* name) : name(name), active(trace_enabled()) {
+    if (active) {
+      trace_record(name, TracePhase::begin);
+    }
+  }
+
+  ~TraceScope() {
+    if (active) {
+      trace_record(name, TracePhase::end);
+    }
+  }
+
+  TraceScope(const TraceScope& copy) = delete;
+  TraceScope& operator=(const TraceScope& copy) = delete;
+};
+
+#define TRACE_SCOPE(name) TraceScope TOKEN_PASTE(trace_scope_, __COUNTER__)(name)
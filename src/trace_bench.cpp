@@ -0,0 +1,42 @@
+// Measure what trace points cost, with tracing disabled and enabled.
+//
+// The accessory read thread records four events per bulk transfer, so this also prints the cost per
+// transfer, to compare against the ms CPU/MiB that the read thread reports.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "trace.h"
+
+constexpr int ITERATIONS = 10000000;
+constexpr int EVENTS_PER_TRANSFER = 4;
+constexpr double TRANSFERS_PER_MIB = 1024.0 * 1024.0 / 16384;
+
+static double measure() {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    TRACE_BEGIN("bench");
+    TRACE_END("bench");
+
+    // Keep the compiler from hoisting the flag check out of the loop.
+    asm volatile("" ::: "memory");
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / (2 * ITERATIONS);
+}
+
+static void report(const char* name, double ns_per_event) {
+  double ms_per_mib = ns_per_event * EVENTS_PER_TRANSFER * TRANSFERS_PER_MIB / 1e6;
+  printf("%-8s %6.2f ns/event, %.4f ms CPU/MiB\n", name, ns_per_event, ms_per_mib);
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = argc > 1 ? argv[1] : "/dev/null";
+
+  report("disabled", measure());
+  trace_start(path);
+  report("enabled", measure());
+  return 0;
+}
@@ -0,0 +1,430 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "accessory_protocol.h"
+#include "chrono_literals.h"
+#include "cpu_time.h"
+#include "log.h"
+#include "trace.h"
+#include "video_scheduler.h"
+
+// StreamService encodes at 30fps, use that until we've seen enough frames to know better.
+constexpr std::chrono::milliseconds INITIAL_FRAME_PERIOD = 33ms;
+
+// The end of an access unit is only known once the next one starts, which would hold every frame
+// back by a frame period. Instead, if nothing else has arrived after this long, hand out whatever
+// we have buffered as a frame. The phone writes each access unit in one go, but a large one can
+// still be split across bulk transfers with a gap between them, in which case the rest of it shows
+// up as a continuation. If nothing has arrived for another FLUSH_TIMEOUT after that, the access
+// unit is taken to be complete, and the decoder is sent a delimiter to tell it so.
+constexpr std::chrono::milliseconds FLUSH_TIMEOUT = 2ms;
+
+// An access unit delimiter, with primary_pic_type = 7 (anything goes).
+constexpr unsigned char ACCESS_UNIT_DELIMITER[] = { 0, 0, 0, 1, 0x09, 0xf0 };
+
+// If nothing has arrived for this long after a frame, the tail of the stream might be stuck in the
+// phone's encoder, so ask for a flush.
+constexpr std::chrono::milliseconds STARVATION_TIMEOUT = 100ms;
+
+// Gain for the running estimates of frame period and jitter (RFC 3550 uses 1/16 for the latter).
+constexpr int ESTIMATE_GAIN = 16;
+
+// Gaps in arrival of more than this many frame periods are the screen being static, not jitter.
+constexpr int MAX_CONTINUOUS_FRAMES = 4;
+
+// The jitter buffer holds on to at most max_latency worth of frames. Allow this many on top of that
+// to be queued up waiting for the decoder before we stop reading from the phone.
+constexpr size_t QUEUE_SLACK_FRAMES = 2;
+
+void H264Framer::append(const unsigned char* data, size_t length, std::vector<H264Chunk>& chunks) {
+  buffer.insert(buffer.end(), data, data + length);
+
+  // We need the start code, the NAL header, and the first byte of the slice header to decide
+  // whether a NAL unit begins a new access unit.
+  size_t access_unit_start = 0;
+  while (scan_offset + 5 <= buffer.size()) {
+    const unsigned char* nal = &buffer[scan_offset];
+    if (nal[0] != 0 || nal[1] != 0 || nal[2] != 1) {
+      ++scan_offset;
+      continue;
+    }
+
+    // https://www.itu.int/rec/T-REC-H.264, section 7.4.1.2.3
+    int nal_type = nal[3] & 0x1f;
+    bool vcl = nal_type >= 1 && nal_type <= 5;
+    bool first_slice = vcl && (nal[4] & 0x80);  // first_mb_in_slice == 0
+    bool delimiter = (nal_type >= 6 && nal_type <= 9) || (nal_type >= 14 && nal_type <= 18);
+
+    if (access_unit_has_vcl && (first_slice || delimiter)) {
+      // The zero byte of a four byte start code belongs to the next access unit.
+      size_t access_unit_end = scan_offset;
+      if (access_unit_end > access_unit_start && buffer[access_unit_end - 1] == 0) {
+        --access_unit_end;
+      }
+
+      // If the access unit was flushed right at its end, there's nothing left of it, but it still
+      // needs to be ended.
+      if (access_unit_end > access_unit_start || flushed) {
+        std::vector<unsigned char> data(buffer.begin() + access_unit_start,
+                                        buffer.begin() + access_unit_end);
+        chunks.push_back({ std::move(data), flushed, true });
+      }
+
+      access_unit_start = access_unit_end;
+      access_unit_has_vcl = false;
+      flushed = false;
+    }
+
+    access_unit_has_vcl |= vcl;
+    scan_offset += 3;
+  }
+
+  if (access_unit_start > 0) {
+    buffer.erase(buffer.begin(), buffer.begin() + access_unit_start);
+    scan_offset -= access_unit_start;
+  }
+}
+
+bool H264Framer::flush(H264Chunk& chunk) {
+  if (buffer.empty()) {
+    return false;
+  }
+
+  // Keep access_unit_has_vcl, so that anything that turns out to be the rest of this access unit
+  // still gets attributed to it.
+  chunk.data.clear();
+  chunk.data.swap(buffer);
+  chunk.continuation = flushed;
+  chunk.complete = false;
+  scan_offset = 0;
+  flushed = true;
+  return true;
+}
+
+bool H264Framer::finish(H264Chunk& chunk) {
+  if (!flushed || !buffer.empty()) {
+    return false;
+  }
+
+  chunk.data.clear();
+  chunk.continuation = true;
+  chunk.complete = true;
+  access_unit_has_vcl = false;
+  flushed = false;
+  return true;
+}
+
+VideoScheduler::VideoScheduler(int input_fd, int output_fd, const VideoSchedulerOptions& options)
+    : input_fd(input_fd), output_fd(output_fd), options(options) {
+}
+
+void VideoScheduler::start() {
+  frame_period = INITIAL_FRAME_PERIOD;
+  max_queued_frames = options.max_latency / INITIAL_FRAME_PERIOD + QUEUE_SLACK_FRAMES;
+
+  debug("video scheduler: smoothness = %.2f, max latency = %d ms", options.smoothness,
+        int(options.max_latency.count()));
+
+  this->read_thread = std::thread([this]() { read_loop(); });
+  this->present_thread = std::thread([this]() { present_loop(); });
+}
+
+void VideoScheduler::set_decoder_pid(pid_t pid) {
+  decoder_pid = pid;
+}
+
+VideoScheduler::duration VideoScheduler::target_delay() const {
+  auto delay = std::chrono::duration_cast<duration>(jitter * options.smoothness);
+  return std::min<duration>(delay, options.max_latency);
+}
+
+void VideoScheduler::enqueue(H264Chunk chunk, clock::time_point arrival) {
+  if (chunk.continuation && have_previous) {
+    // The rest of a frame that we've already scheduled goes out right behind it, without counting
+    // as a frame of its own for the estimates.
+    TRACE_INSTANT("frame continuation");
+    Frame frame{ std::move(chunk.data), arrival, previous_presentation, duration::zero(), false,
+                 true, chunk.complete };
+    previous_arrival = arrival;
+    push(std::move(frame));
+    return;
+  }
+
+  TRACE_INSTANT("frame arrived");
+
+  // The frames pushed through by a flush don't need flushing themselves, but anything beyond them
+  // is a real change to the screen, whose tail might get stuck in turn.
+  if (flush_frames_expected > 0) {
+    --flush_frames_expected;
+  } else {
+    starvation_armed = true;
+  }
+  Frame frame{ std::move(chunk.data), arrival, arrival, target_delay(), false, false,
+               chunk.complete };
+
+  if (have_previous) {
+    duration delta = arrival - previous_arrival;
+    if (delta < MAX_CONTINUOUS_FRAMES * frame_period) {
+      frame.continuous = true;
+      frame_period += (delta - frame_period) / ESTIMATE_GAIN;
+
+      duration deviation = delta > frame_period ? delta - frame_period : frame_period - delta;
+      jitter += (deviation - jitter) / ESTIMATE_GAIN;
+      frame.delay = target_delay();
+    }
+  }
+
+  // Hand frames to the decoder one frame period apart, unless that would mean either sending a
+  // frame before it arrived, or holding on to it for longer than the jitter buffer allows.
+  if (options.pace_frames) {
+    frame.presentation = arrival + frame.delay;
+    if (frame.continuous) {
+      frame.presentation = std::min(std::max(previous_presentation + frame_period, arrival),
+                                    frame.presentation);
+    }
+  } else {
+    frame.delay = duration::zero();
+  }
+
+  have_previous = true;
+  previous_arrival = arrival;
+  previous_presentation = frame.presentation;
+  push(std::move(frame));
+}
+
+void VideoScheduler::push(Frame frame) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!frame.continuation) {
+    if (queued_frames >= max_queued_frames) {
+      TRACE_SCOPE("wait for decoder");
+      queue_space.wait(lock, [this]() { return queued_frames < max_queued_frames; });
+    }
+    ++queued_frames;
+  }
+
+  queue.push_back(std::move(frame));
+  cv.notify_one();
+}
+
+void VideoScheduler::request_flush() {
+  debug("video stream stalled, requesting flush");
+  TRACE_INSTANT("flush request");
+
+  flush_frames_expected = ACCESSORY_FLUSH_FRAMES;
+  unsigned char command = static_cast<unsigned char>(AccessoryCommand::flush);
+  ssize_t written = write(input_fd, &command, sizeof(command));
+  if (written < 0) {
+    fatal("write failed: %s", strerror(errno));
+  } else if (written == 0) {
+    fatal("write returned EOF");
+  }
+}
+
+void VideoScheduler::read_loop() {
+  trace_set_thread_name("video read");
+  std::vector<H264Chunk> chunks;
+  H264Chunk chunk;
+
+  // Whether the framer has data that hasn't been flushed yet.
+  bool pending = false;
+
+  // Whether an access unit has been flushed, but not finished.
+  bool unfinished = false;
+
+  while (true) {
+    int timeout = -1;
+    if (pending || unfinished) {
+      timeout = int(FLUSH_TIMEOUT.count());
+    } else if (starvation_armed) {
+      auto remaining = last_data + STARVATION_TIMEOUT - clock::now();
+      auto remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining) + 1ms;
+      timeout = std::max(0, int(remaining_ms.count()));
+    }
+
+    struct pollfd pfd = {.fd = input_fd, .events = POLLIN, .revents = 0 };
+    int rc = poll(&pfd, 1, timeout);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatal("poll failed: %s", strerror(errno));
+    }
+
+    if (rc == 0) {
+      auto now = clock::now();
+      if (pending) {
+        if (framer.flush(chunk)) {
+          enqueue(std::move(chunk), now);
+        }
+        pending = false;
+        unfinished = true;
+      } else if (unfinished) {
+        if (framer.finish(chunk)) {
+          enqueue(std::move(chunk), now);
+        }
+        unfinished = false;
+      } else if (starvation_armed && now - last_data >= STARVATION_TIMEOUT) {
+        request_flush();
+        starvation_armed = false;
+      }
+      continue;
+    }
+
+    unsigned char buffer[16384];
+    ssize_t bytes_read = read(input_fd, buffer, sizeof(buffer));
+    if (bytes_read < 0) {
+      fatal("read failed: %s", strerror(errno));
+    } else if (bytes_read == 0) {
+      break;
+    }
+
+    auto now = clock::now();
+    bytes_received += bytes_read;
+    last_data = now;
+
+    framer.append(buffer, bytes_read, chunks);
+    for (auto& complete_chunk : chunks) {
+      enqueue(std::move(complete_chunk), now);
+    }
+    chunks.clear();
+    pending = true;
+  }
+
+  if (framer.flush(chunk)) {
+    enqueue(std::move(chunk), clock::now());
+  }
+  if (framer.finish(chunk)) {
+    enqueue(std::move(chunk), clock::now());
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  eof = true;
+  cv.notify_one();
+}
+
+static void write_fully(int fd, const unsigned char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      fatal("write failed: %s", strerror(errno));
+    } else if (written == 0) {
+      fatal("write returned EOF");
+    }
+
+    data += written;
+    length -= written;
+  }
+}
+
+void VideoScheduler::present_loop() {
+  trace_set_thread_name("video present");
+  using milliseconds = std::chrono::duration<double, std::milli>;
+  using minutes = std::chrono::duration<double, std::ratio<60>>;
+
+  size_t frames = 0;
+  size_t intervals = 0;
+  double interval_mean = 0;
+  double interval_m2 = 0;
+  double latency_total = 0;
+  duration target_delay = duration::zero();
+  bool presented = false;
+  clock::time_point last_presentation;
+  clock::time_point last_report = clock::now();
+  auto last_report_cpu_time = cpu_time(RUSAGE_SELF);
+  auto decoder_cpu_time = [this]() {
+    pid_t pid = decoder_pid;
+    return pid > 0 ? process_cpu_time(pid) : std::chrono::microseconds::zero();
+  };
+  auto last_report_decoder_cpu_time = decoder_cpu_time();
+
+  while (true) {
+    bool have_frame = false;
+    Frame frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait_until(lock, last_report + options.report_interval,
+                    [this]() { return !queue.empty() || eof; });
+      if (!queue.empty()) {
+        frame = std::move(queue.front());
+        queue.pop_front();
+        have_frame = true;
+        if (!frame.continuation) {
+          --queued_frames;
+          queue_space.notify_one();
+        }
+      } else if (eof) {
+        break;
+      }
+    }
+
+    if (have_frame) {
+      std::this_thread::sleep_until(frame.presentation);
+
+      TRACE_SCOPE("present frame");
+      write_fully(output_fd, frame.data.data(), frame.data.size());
+      if (frame.complete) {
+        write_fully(output_fd, ACCESS_UNIT_DELIMITER, sizeof(ACCESS_UNIT_DELIMITER));
+      }
+
+      // Continuations are part of a frame that has already been counted.
+      if (!frame.continuation) {
+        auto now = clock::now();
+        if (frame.continuous && presented) {
+          // Welford's algorithm for the variance of the time between frames.
+          double interval = milliseconds(now - last_presentation).count();
+          double delta = interval - interval_mean;
+          interval_mean += delta / ++intervals;
+          interval_m2 += delta * (interval - interval_mean);
+        }
+
+        latency_total += milliseconds(now - frame.arrival).count();
+        target_delay = frame.delay;
+        last_presentation = now;
+        presented = true;
+        ++frames;
+      }
+    }
+
+    // Report even when the screen is static, so that we can see what it costs to sit idle.
+    auto now = clock::now();
+    if (now - last_report >= options.report_interval) {
+      double elapsed = minutes(now - last_report).count();
+      double bytes = bytes_received.exchange(0);
+      auto current_cpu_time = cpu_time(RUSAGE_SELF);
+      auto current_decoder_cpu_time = decoder_cpu_time();
+      double cpu = milliseconds(current_cpu_time - last_report_cpu_time).count();
+
+      // Most of the cost of pushing frames to the screen is in the decoder's process.
+      double decoder_cpu = std::max(
+        0.0, milliseconds(current_decoder_cpu_time - last_report_decoder_cpu_time).count());
+
+      // These are measured at the point frames are handed to the decoder, not on the screen.
+      double variance = intervals > 1 ? interval_m2 / (intervals - 1) : 0;
+      info("video: %zu frames, sent to decoder every %.2f ms (variance %.2f ms^2), held for "
+           "%.2f ms (target %.2f ms), %.1f KiB/min, %.0f ms CPU/min (%.0f mimic, %.0f decoder)",
+           frames, interval_mean, variance, frames ? latency_total / frames : 0,
+           milliseconds(target_delay).count(), bytes / 1024 / elapsed,
+           (cpu + decoder_cpu) / elapsed, cpu / elapsed, decoder_cpu / elapsed);
+
+      frames = 0;
+      intervals = 0;
+      interval_mean = 0;
+      interval_m2 = 0;
+      latency_total = 0;
+      last_report = now;
+      last_report_cpu_time = current_cpu_time;
+      last_report_decoder_cpu_time = current_decoder_cpu_time;
+    }
+  }
+
+  close(output_fd);
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "chrono_literals.h"
+
+// A piece of the stream handed out by H264Framer.
+struct H264Chunk {
+  std::vector<unsigned char> data;
+
+  // Whether this is the rest of an access unit that was flushed before it was complete.
+  bool continuation;
+
+  // Whether this chunk ends its access unit.
+  bool complete;
+};
+
+// Splits an H.264 Annex B byte stream into access units.
+class H264Framer {
+ private:
+  std::vector<unsigned char> buffer;
+  size_t scan_offset = 0;
+  bool access_unit_has_vcl = false;
+
+  // Whether some of the current access unit has already been handed out by flush().
+  bool flushed = false;
+
+ public:
+  // Appends data to the stream, and moves every access unit that it completes into chunks.
+  void append(const unsigned char* data, size_t length, std::vector<H264Chunk>& chunks);
+
+  // Hand out everything that has been buffered, without waiting for the next access unit to start.
+  // If the access unit turns out to have been incomplete, the rest is handed out as a continuation.
+  bool flush(H264Chunk& chunk);
+
+  // Declare the access unit that was last flushed complete, handing out an empty chunk that ends
+  // it. Anything that shows up afterwards is treated as the start of the next access unit.
+  bool finish(H264Chunk& chunk);
+};
+
+struct VideoSchedulerOptions {
+  // Whether to buffer and pace frames at all, instead of presenting them as they arrive.
+  bool pace_frames = true;
+
+  // How many multiples of the estimated arrival jitter to buffer before presenting a frame.
+  // Higher values are smoother, lower values have less latency.
+  double smoothness = 2.0;
+
+  // Upper bound on the latency added by the jitter buffer. If the decoder falls behind, frames
+  // queue up on top of this, but only a couple before we stop reading from the phone.
+  std::chrono::milliseconds max_latency = 50ms;
+
+  // How often to report statistics.
+  std::chrono::seconds report_interval = 10s;
+};
+
+// Paces video frames read from input_fd into output_fd, which feeds the decoder.
+//
+// Frames come off of the USB bulk endpoint in bursts, and the sink shows them as soon as they're
+// decoded, so passing them straight through shows up as judder. Instead, estimate the arrival
+// jitter, and delay handing frames to the decoder by just enough to smooth it out. This only
+// controls when the decoder gets a frame: decoding adds its own, variable delay on top, and
+// nothing here knows when the display refreshes.
+//
+// h264parse only knows that an access unit is over once the next one starts, so each one is
+// followed by an access unit delimiter, to keep it from being held back by a frame.
+//
+// The phone only encodes frames when its screen changes, and its encoder can hold on to the last
+// few frames until something else comes along. input_fd is the accessory socket, so when the
+// stream stalls, ask the phone to flush them out.
+class VideoScheduler {
+ private:
+  using clock = std::chrono::steady_clock;
+  using duration = clock::duration;
+
+  struct Frame {
+    std::vector<unsigned char> data;
+    clock::time_point arrival;
+    clock::time_point presentation;
+
+    // Target jitter buffer delay at the time the frame arrived.
+    duration delay;
+
+    // Whether this frame follows the previous one closely enough for its frame time to count.
+    bool continuous;
+
+    // Whether this is the rest of the previous frame, rather than a frame of its own.
+    bool continuation;
+
+    // Whether this ends the access unit, and should be followed by a delimiter.
+    bool complete;
+  };
+
+  int input_fd;
+  int output_fd;
+  VideoSchedulerOptions options;
+
+  std::thread read_thread;
+  std::thread present_thread;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Frame> queue;
+  bool eof = false;
+
+  // Frames in the queue, not counting continuations. When this reaches max_queued_frames, the read
+  // thread waits on queue_space, so that a decoder that can't keep up pushes back on the phone.
+  size_t queued_frames = 0;
+  size_t max_queued_frames;
+  std::condition_variable queue_space;
+
+  // Bytes received, for the statistics reported by the present thread.
+  std::atomic<size_t> bytes_received{ 0 };
+
+  // The process decoding output_fd, whose CPU usage gets reported along with ours.
+  std::atomic<pid_t> decoder_pid{ -1 };
+
+  // State owned by the read thread.
+  H264Framer framer;
+  bool have_previous = false;
+  clock::time_point previous_arrival;
+  clock::time_point previous_presentation;
+  duration frame_period;
+  duration jitter = duration::zero();
+  clock::time_point last_data;
+  bool starvation_armed = false;
+
+  // Frames still expected as a result of the last flush request.
+  int flush_frames_expected = 0;
+
+ public:
+  VideoScheduler(int input_fd, int output_fd, const VideoSchedulerOptions& options);
+
+  void start();
+  void set_decoder_pid(pid_t pid);
+
+ private:
+  void read_loop();
+  void present_loop();
+  void enqueue(H264Chunk chunk, clock::time_point arrival);
+  void push(Frame frame);
+  void request_flush();
+  duration target_delay() const;
+};